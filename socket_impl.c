@@ -1,18 +1,28 @@
 // C implementation for TCP sockets using POSIX sockets
-// This file provides the actual socket operations for the FFI
+// This file provides the actual socket operations for the FFI,
+// plus the file helpers used for on-disk cache snapshots
 //
 // Supports:
 // - POSIX sockets (Linux, macOS, Unix)
 // - Winsock (Windows)
 
+// For CPU affinity (cpu_set_t, pthread_setaffinity_np)
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <io.h>
 #pragma comment(lib, "ws2_32.lib")
 typedef int socklen_t;
 #else
@@ -22,11 +32,50 @@ typedef int socklen_t;
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
 typedef int SOCKET;
 #endif
 
+// Writes to a socket the peer (or ibmoon_socket_close on another thread)
+// has shut down must fail with EPIPE rather than raise SIGPIPE. Linux takes
+// MSG_NOSIGNAL per call; macOS and the BSDs set SO_NOSIGPIPE at connect
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Wall-clock time in milliseconds since the Unix epoch
+int64_t ibmoon_current_time_ms(void) {
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    int64_t t = ((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (t - 116444736000000000LL) / 10000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+// Monotonic time in milliseconds, for pacing and timeouts
+int64_t ibmoon_monotonic_ms(void) {
+#ifdef _WIN32
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 // Error codes matching MoonBit enum
 #define ERROR_NONE 0
 #define ERROR_CONNECTION_REFUSED 1
@@ -35,63 +84,170 @@ typedef int SOCKET;
 #define ERROR_INVALID_SOCKET 4
 #define ERROR_UNKNOWN 5
 
-// Maximum number of active sockets
+// Maximum number of active sockets (a power of two)
 #define MAX_SOCKETS 256
+#define SOCKET_SLOT_BITS 8
+
+// Socket table
+// Safe for concurrent connect, send, receive and close. A socket id is
+// (slot generation << SOCKET_SLOT_BITS) | slot, so an id that outlived its
+// socket never finds the slot's next occupant. Each slot has one 64-bit
+// state word: the generation in the high half, a closing bit, and the
+// number of operations using the handle. Lookups take no lock: they count
+// themselves in with a CAS that only succeeds while the generation matches
+// their id and the slot is not closing, so a user is always counted against
+// its own socket. Store and remove serialize on a spinlock. Remove sets the
+// closing bit (no new users), shuts the socket down to wake blocked users,
+// closes it after the last one has left, and only then frees the slot for
+// reuse, so the wait is bounded by operations already in flight
+#define SLOT_CLOSING 0x80000000ULL
+#define SLOT_USERS 0x7FFFFFFFULL
+
+typedef struct {
+    // generation << 32 | SLOT_CLOSING | users
+    uint64_t state;
+    // Full socket id while in use, -1 while closing, 0 while free
+    int id;
+    SOCKET sock;
+} socket_slot;
 
-// Socket storage
-static SOCKET sockets[MAX_SOCKETS];
-static int socket_count = 0;
-static int next_socket_id = 1;
+static socket_slot socket_slots[MAX_SOCKETS];
+static int socket_table_lock = 0;
+// Where the next free-slot scan starts, so slots are reused round robin
+static uint32_t next_socket_slot = 0;
 
-// Initialize Winsock on Windows
+static void yield_thread(void) {
 #ifdef _WIN32
-static int winsock_initialized = 0;
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static void lock_socket_table(void) {
+    while (__atomic_exchange_n(&socket_table_lock, 1, __ATOMIC_ACQUIRE)) {
+        yield_thread();
+    }
+}
+
+static void unlock_socket_table(void) {
+    __atomic_store_n(&socket_table_lock, 0, __ATOMIC_RELEASE);
+}
+
+// Initialize Winsock on Windows, once, whichever thread gets here first
+#ifdef _WIN32
+static volatile LONG winsock_state = 0;
 static void init_winsock(void) {
-    if (!winsock_initialized) {
+    if (InterlockedCompareExchange(&winsock_state, 1, 0) == 0) {
         WSADATA wsa_data;
-        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0) {
-            winsock_initialized = 1;
-        }
+        // Back to 0 on failure so a later call can retry
+        InterlockedExchange(&winsock_state,
+                            WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0 ? 2 : 0);
+        return;
+    }
+    while (winsock_state == 1) {
+        Sleep(0);
     }
 }
 #endif
 
-// Store socket and return ID
+// Store socket and return ID, or -1 if the table is full
 static int store_socket(SOCKET sock) {
 #ifdef _WIN32
     init_winsock();
 #endif
-    
-    if (socket_count >= MAX_SOCKETS) {
-        return -1;
+    int socket_id = -1;
+    lock_socket_table();
+    uint32_t start = __atomic_fetch_add(&next_socket_slot, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        int idx = (int)((start + (uint32_t)i) & (MAX_SOCKETS - 1));
+        socket_slot* slot = &socket_slots[idx];
+        if (slot->id == 0) {
+            // A free slot has no users and is closed to stale ids
+            uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+            uint32_t generation = (uint32_t)((state >> 32) + 1) & 0x7FFFFF;
+            if (generation == 0) {
+                generation = 1;
+            }
+            socket_id = (int)(generation << SOCKET_SLOT_BITS) | idx;
+            slot->id = socket_id;
+            __atomic_store_n(&slot->sock, sock, __ATOMIC_RELAXED);
+            // Publishes sock to lookups that see the new generation
+            __atomic_store_n(&slot->state, (uint64_t)generation << 32, __ATOMIC_RELEASE);
+            break;
+        }
     }
-    
-    int socket_id = next_socket_id++;
-    int idx = socket_id % MAX_SOCKETS;
-    sockets[idx] = sock;
-    socket_count++;
-    
+    unlock_socket_table();
     return socket_id;
 }
 
-// Find socket by ID
-static SOCKET find_socket(int socket_id) {
-    int idx = socket_id % MAX_SOCKETS;
-    return sockets[idx];
+// Look up a socket for one operation; pair with release_socket
+// Returns INVALID_SOCKET (and holds nothing) if the id is stale, unknown or
+// being closed
+static SOCKET acquire_socket(int socket_id) {
+    if (socket_id <= 0) {
+        return INVALID_SOCKET;
+    }
+    socket_slot* slot = &socket_slots[socket_id & (MAX_SOCKETS - 1)];
+    uint64_t generation = (uint32_t)socket_id >> SOCKET_SLOT_BITS;
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    do {
+        if ((state >> 32) != generation || (state & SLOT_CLOSING) != 0) {
+            return INVALID_SOCKET;
+        }
+    } while (!__atomic_compare_exchange_n(&slot->state, &state, state + 1, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return __atomic_load_n(&slot->sock, __ATOMIC_RELAXED);
 }
 
-// Remove socket from storage
-static void remove_socket(int socket_id) {
-    int idx = socket_id % MAX_SOCKETS;
-    if (sockets[idx] != INVALID_SOCKET) {
+// Claim a free reader or queue entry; 1 if this thread got it
+static int claim_handle(int* in_use) {
+    int expected = 0;
+    return __atomic_compare_exchange_n(in_use, &expected, 1, 0, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED);
+}
+
+// The slot keeps socket_id's generation until every user has released it
+static void release_socket(int socket_id) {
+    socket_slot* slot = &socket_slots[socket_id & (MAX_SOCKETS - 1)];
+    __atomic_sub_fetch(&slot->state, 1, __ATOMIC_RELEASE);
+}
+
+// Remove socket from storage and close it once no operation is using it
+// Returns 0, or -1 if the id is stale, unknown or already being closed
+static int remove_socket(int socket_id) {
+    if (socket_id <= 0) {
+        return -1;
+    }
+    socket_slot* slot = &socket_slots[socket_id & (MAX_SOCKETS - 1)];
+    lock_socket_table();
+    if (slot->id != socket_id) {
+        unlock_socket_table();
+        return -1;
+    }
+    slot->id = -1;
+    __atomic_fetch_or(&slot->state, SLOT_CLOSING, __ATOMIC_ACQ_REL);
+    unlock_socket_table();
+    SOCKET sock = __atomic_load_n(&slot->sock, __ATOMIC_RELAXED);
 #ifdef _WIN32
-        closesocket(sockets[idx]);
+    shutdown(sock, SD_BOTH);
 #else
-        close(sockets[idx]);
+    shutdown(sock, SHUT_RDWR);
 #endif
-        sockets[idx] = INVALID_SOCKET;
-        socket_count--;
+    // Users left are inside one send, recv or poll, which the shutdown ends
+    while ((__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) & SLOT_USERS) != 0) {
+        yield_thread();
     }
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+    // The closing bit stays set, so stale ids keep failing until reuse
+    lock_socket_table();
+    slot->id = 0;
+    unlock_socket_table();
+    return 0;
 }
 
 // Get error code from errno
@@ -124,6 +280,69 @@ static int get_socket_error(void) {
 #endif
 }
 
+// CPU affinity and busy polling
+// For latency-critical setups a thread can be pinned to a core, and a
+// receive can spin on a non-blocking recv for a budget of microseconds
+// before falling back to a blocking one, trading a core for wake-up latency
+
+// Pin the calling thread to cpu; returns 0, or -1 if unsupported or invalid
+int ibmoon_pin_current_thread(int cpu) {
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+#elif defined(_WIN32)
+    if (cpu < 0 || cpu >= (int)(sizeof(DWORD_PTR) * 8)) {
+        return -1;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0 ? 0 : -1;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static int64_t monotonic_us(void) {
+#ifdef _WIN32
+    return (int64_t)GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Spin on a non-blocking recv for up to busy_poll_us
+// Returns what recv returned, or -2 if nothing arrived within the budget
+static int recv_busy_poll(SOCKET sock, char* buffer, int length, int busy_poll_us) {
+#ifdef _WIN32
+    (void)sock; (void)buffer; (void)length; (void)busy_poll_us;
+    return -2;
+#else
+    int64_t deadline = monotonic_us() + busy_poll_us;
+    do {
+        int n = recv(sock, buffer, length, MSG_DONTWAIT);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return n;
+        }
+        cpu_relax();
+    } while (monotonic_us() < deadline);
+    return -2;
+#endif
+}
+
 // Connect to a TCP socket
 // Returns: { success: int, value: int, error: int }
 void ibmoon_socket_connect(const char* host, int port, int timeout_ms, 
@@ -246,6 +465,10 @@ void ibmoon_socket_connect(const char* host, int port, int timeout_ms,
     flags = fcntl(sock, F_GETFL, 0);
     fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
 #endif
+#ifdef SO_NOSIGPIPE
+    int no_sigpipe = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
     
     // Store socket
     int socket_id = store_socket(sock);
@@ -270,7 +493,7 @@ void ibmoon_socket_connect(const char* host, int port, int timeout_ms,
 // Returns: { success: int, value: int, error: int }
 void ibmoon_socket_send(int socket_id, const unsigned char* data, int length,
                       int* out_success, int* out_value, int* out_error) {
-    SOCKET sock = find_socket(socket_id);
+    SOCKET sock = acquire_socket(socket_id);
     
     if (sock == INVALID_SOCKET) {
         *out_success = 0;
@@ -279,7 +502,8 @@ void ibmoon_socket_send(int socket_id, const unsigned char* data, int length,
         return;
     }
     
-    int bytes_sent = send(sock, (const char*)data, length, 0);
+    int bytes_sent = send(sock, (const char*)data, length, SEND_FLAGS);
+    release_socket(socket_id);
     
     if (bytes_sent == SOCKET_ERROR) {
         *out_success = 0;
@@ -297,7 +521,7 @@ void ibmoon_socket_send(int socket_id, const unsigned char* data, int length,
 // Returns: { success: int, value: int, error: int }
 void ibmoon_socket_receive(int socket_id, unsigned char* buffer, int buffer_len, int timeout_ms,
                           int* out_success, int* out_value, int* out_error) {
-    SOCKET sock = find_socket(socket_id);
+    SOCKET sock = acquire_socket(socket_id);
     
     if (sock == INVALID_SOCKET) {
         *out_success = 0;
@@ -320,6 +544,7 @@ void ibmoon_socket_receive(int socket_id, unsigned char* buffer, int buffer_len,
     }
     
     int bytes_received = recv(sock, (char*)buffer, buffer_len, 0);
+    release_socket(socket_id);
     
     if (bytes_received == SOCKET_ERROR) {
         *out_success = 0;
@@ -345,18 +570,943 @@ void ibmoon_socket_receive(int socket_id, unsigned char* buffer, int buffer_len,
 // Returns: { success: int, value: int, error: int }
 void ibmoon_socket_close(int socket_id,
                        int* out_success, int* out_value, int* out_error) {
-    SOCKET sock = find_socket(socket_id);
-    
-    if (sock == INVALID_SOCKET) {
+    // Waits for operations in flight on other threads, then closes
+    if (remove_socket(socket_id) != 0) {
         *out_success = 0;
         *out_value = 0;
         *out_error = ERROR_INVALID_SOCKET;
         return;
     }
     
-    remove_socket(socket_id);
-    
     *out_success = 1;
     *out_value = 0;
     *out_error = ERROR_NONE;
-}
\ No newline at end of file
+}
+
+// Batch arena
+// The arena is a byte buffer owned by MoonBit and reused across batches.
+// recv appends at the bump offset, frames are indexed in place and decoded
+// straight out of the buffer; MoonBit resets the offset after dispatch
+
+// Receive into buffer[offset, capacity), busy polling first if busy_poll_us > 0
+// Returns bytes received, 0 on timeout, -1 if closed, -2 on error
+int ibmoon_socket_receive_into(int socket_id, unsigned char* buffer, int offset,
+                               int capacity, int timeout_ms, int busy_poll_us) {
+    if (offset >= capacity) {
+        return -2;
+    }
+    SOCKET sock = acquire_socket(socket_id);
+    if (sock == INVALID_SOCKET) {
+        return -2;
+    }
+    if (timeout_ms > 0) {
+#ifdef _WIN32
+        DWORD timeout = timeout_ms;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#else
+        struct timeval tv;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+    }
+    int n = busy_poll_us > 0
+                ? recv_busy_poll(sock, (char*)buffer + offset, capacity - offset, busy_poll_us)
+                : -2;
+    if (n == -2) {
+        n = recv(sock, (char*)buffer + offset, capacity - offset, 0);
+    }
+    release_socket(socket_id);
+    if (n > 0) {
+        return n;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    return get_socket_error() == ERROR_TIMEOUT || errno == EAGAIN ? 0 : -2;
+}
+
+// Wait up to timeout_ms until any of count sockets has data (or was closed)
+// Sets ready[i] to 1 for each readable socket and 0 otherwise. Returns the
+// number of ready sockets, 0 on timeout, -1 on error or an unknown id
+#define MAX_WAIT_SOCKETS 64
+int ibmoon_socket_wait_readable(const int* socket_ids, int* ready, int count,
+                                int timeout_ms) {
+    if (count <= 0 || count > MAX_WAIT_SOCKETS) {
+        return -1;
+    }
+#ifdef _WIN32
+    WSAPOLLFD fds[MAX_WAIT_SOCKETS];
+#else
+    struct pollfd fds[MAX_WAIT_SOCKETS];
+#endif
+    int acquired = 0;
+    for (; acquired < count; acquired++) {
+        SOCKET sock = acquire_socket(socket_ids[acquired]);
+        if (sock == INVALID_SOCKET) {
+            break;
+        }
+        fds[acquired].fd = sock;
+        fds[acquired].events = POLLIN;
+        fds[acquired].revents = 0;
+    }
+    int n = -1;
+    if (acquired == count) {
+#ifdef _WIN32
+        n = WSAPoll(fds, (ULONG)count, timeout_ms);
+#else
+        do {
+            n = poll(fds, (nfds_t)count, timeout_ms);
+        } while (n < 0 && errno == EINTR);
+#endif
+    }
+    for (int i = 0; i < acquired; i++) {
+        release_socket(socket_ids[i]);
+    }
+    if (n < 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        ready[i] = (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+    }
+    return n;
+}
+
+// Index 4-byte big-endian length-prefixed frames in buffer[start, end)
+// Writes payload offsets and lengths; stops at the first incomplete frame
+// or after max_frames. Returns the frame count
+int ibmoon_index_frames(const unsigned char* buffer, int start, int end,
+                        int* starts, int* lengths, int max_frames) {
+    int count = 0;
+    int pos = start;
+    while (count < max_frames && end - pos >= 4) {
+        int len = ((int)buffer[pos] << 24) | ((int)buffer[pos + 1] << 16) |
+                  ((int)buffer[pos + 2] << 8) | (int)buffer[pos + 3];
+        if (len < 0 || end - pos - 4 < len) {
+            break;
+        }
+        starts[count] = pos + 4;
+        lengths[count] = len;
+        count++;
+        pos += 4 + len;
+    }
+    return count;
+}
+
+// Move buffer[from, end) to the front; returns the new fill offset
+int ibmoon_arena_compact(unsigned char* buffer, int from, int end) {
+    if (from > 0 && end > from) {
+        memmove(buffer, buffer + from, (size_t)(end - from));
+    }
+    return end > from ? end - from : 0;
+}
+
+// Reader thread
+// A reader thread owns the receive side of a socket: it frames the stream
+// and copies each frame into one single-producer, single-consumer ring.
+// MoonBit is the only consumer. Callbacks all run on the MoonBit thread,
+// so the rings are not split per shard: that would add copies without
+// adding parallelism. What the thread buys is socket reads and framing
+// overlapping with dispatch. The ring holds length-prefixed frames, the
+// same layout the batch arena indexes, in arrival order
+
+#define MAX_READERS 16
+#define READER_BUFFER_SIZE 65536
+
+typedef struct {
+    unsigned char* data;
+    uint64_t mask;
+    // Written by the reader thread only
+    uint64_t head;
+    char pad_head[56];
+    // Written by the consumer only
+    uint64_t tail;
+    char pad_tail[56];
+} frame_ring;
+
+typedef struct {
+    int in_use;
+    // Looked up per receive, so a close from another thread is safe
+    int socket_id;
+    // Core to pin the reader thread to, -1 for none
+    int cpu;
+    // Spin budget for the reader's recv and for ibmoon_reader_wait
+    int busy_poll_us;
+    frame_ring ring;
+    int stop;
+    int closed;
+    // Set while the consumer sleeps in ibmoon_reader_wait
+    int waiting;
+#ifndef _WIN32
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+#endif
+} frame_reader;
+
+static frame_reader readers[MAX_READERS];
+
+static int read_be32(const unsigned char* p) {
+    return ((int)p[0] << 24) | ((int)p[1] << 16) | ((int)p[2] << 8) | (int)p[3];
+}
+
+static frame_reader* find_reader(int handle) {
+    if (handle < 0 || handle >= MAX_READERS || !readers[handle].in_use) {
+        return NULL;
+    }
+    return &readers[handle];
+}
+
+#ifndef _WIN32
+// Wake the consumer if it sleeps in ibmoon_reader_wait
+static void reader_wake(frame_reader* r) {
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->ready);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// Copy frames (prefixes included) into the ring, waiting while it is full
+// A full ring wakes the consumer first, so it cannot sleep on a stalled reader
+// Returns 0 when the reader is being stopped
+static int reader_push(frame_reader* r, const unsigned char* frames, int size) {
+    frame_ring* ring = &r->ring;
+    uint64_t capacity = ring->mask + 1;
+    uint64_t head = ring->head;
+    while (head + (uint64_t)size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > capacity) {
+        reader_wake(r);
+        if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        sched_yield();
+    }
+    uint64_t at = head & ring->mask;
+    uint64_t first = capacity - at < (uint64_t)size ? capacity - at : (uint64_t)size;
+    memcpy(ring->data + at, frames, first);
+    memcpy(ring->data, frames + first, (size_t)size - first);
+    __atomic_store_n(&ring->head, head + (uint64_t)size, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+static void* reader_main(void* arg) {
+    frame_reader* r = (frame_reader*)arg;
+    int capacity = READER_BUFFER_SIZE;
+    int used = 0;
+    unsigned char* buffer = (unsigned char*)malloc((size_t)capacity);
+    uint64_t ring_capacity = r->ring.mask + 1;
+    if (r->cpu >= 0) {
+        ibmoon_pin_current_thread(r->cpu);
+    }
+    // Short receive timeout so a stop request is noticed
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    SOCKET sock = acquire_socket(r->socket_id);
+    if (sock == INVALID_SOCKET) {
+        goto done;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    release_socket(r->socket_id);
+    while (buffer != NULL && !__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        sock = acquire_socket(r->socket_id);
+        if (sock == INVALID_SOCKET) {
+            break;
+        }
+        int n = r->busy_poll_us > 0
+                    ? recv_busy_poll(sock, (char*)buffer + used, capacity - used, r->busy_poll_us)
+                    : -2;
+        if (n == -2) {
+            n = recv(sock, (char*)buffer + used, capacity - used, 0);
+        }
+        release_socket(r->socket_id);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        used += n;
+        // Push runs of whole frames, each run no larger than the ring
+        int pos = 0;
+        int run = 0;
+        while (used - pos - run >= 4) {
+            int len = read_be32(buffer + pos + run);
+            if (len < 0 || (uint64_t)len + 4 > ring_capacity) {
+                goto done;
+            }
+            if (used - pos - run - 4 < len) {
+                break;
+            }
+            if ((uint64_t)run + 4 + (uint64_t)len > ring_capacity) {
+                if (!reader_push(r, buffer + pos, run)) {
+                    goto done;
+                }
+                pos += run;
+                run = 0;
+            }
+            run += 4 + len;
+        }
+        if (run > 0) {
+            if (!reader_push(r, buffer + pos, run)) {
+                goto done;
+            }
+            pos += run;
+            reader_wake(r);
+        }
+        used = ibmoon_arena_compact(buffer, pos, used);
+        if (used == capacity) {
+            unsigned char* grown = (unsigned char*)realloc(buffer, (size_t)capacity * 2);
+            if (grown == NULL) {
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+    }
+done:
+    free(buffer);
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+#endif
+
+// Start a reader thread for socket_id with a ring of 2^ring_log2 bytes
+// The thread is pinned to cpu unless it is -1, and busy polls for
+// busy_poll_us before blocking
+// Returns a reader handle, or -1 on error (always on Windows)
+int ibmoon_reader_start(int socket_id, int ring_log2, int cpu, int busy_poll_us) {
+#ifdef _WIN32
+    (void)socket_id; (void)ring_log2; (void)cpu; (void)busy_poll_us;
+    return -1;
+#else
+    if (ring_log2 < 10 || ring_log2 > 30) {
+        return -1;
+    }
+    if (acquire_socket(socket_id) == INVALID_SOCKET) {
+        return -1;
+    }
+    release_socket(socket_id);
+    int handle = -1;
+    for (int i = 0; i < MAX_READERS && handle < 0; i++) {
+        if (claim_handle(&readers[i].in_use)) {
+            handle = i;
+        }
+    }
+    if (handle < 0) {
+        return -1;
+    }
+    frame_reader* r = &readers[handle];
+    // Everything after in_use, which now marks the entry as ours
+    memset(&r->socket_id, 0, sizeof(*r) - offsetof(frame_reader, socket_id));
+    r->socket_id = socket_id;
+    r->cpu = cpu;
+    r->busy_poll_us = busy_poll_us;
+    r->ring.data = (unsigned char*)malloc((size_t)1 << ring_log2);
+    r->ring.mask = ((uint64_t)1 << ring_log2) - 1;
+    if (r->ring.data == NULL) {
+        __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    if (pthread_create(&r->thread, NULL, reader_main, r) != 0) {
+        free(r->ring.data);
+        r->ring.data = NULL;
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->ready);
+        __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return handle;
+#endif
+}
+
+// Size of the next frame in the ring, prefix included
+// Returns 0 if the ring is empty, -1 if it is empty and the reader stopped
+int ibmoon_reader_next_size(int handle) {
+    frame_reader* r = find_reader(handle);
+    if (r == NULL) {
+        return -1;
+    }
+    frame_ring* ring = &r->ring;
+    int closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == ring->tail) {
+        return closed ? -1 : 0;
+    }
+    unsigned char prefix[4];
+    for (int i = 0; i < 4; i++) {
+        prefix[i] = ring->data[(ring->tail + (uint64_t)i) & ring->mask];
+    }
+    return read_be32(prefix) + 4;
+}
+
+// Move whole frames from the ring into buffer[offset, capacity)
+// Returns the number of bytes moved
+int ibmoon_reader_drain(int handle, unsigned char* buffer, int offset, int capacity) {
+    frame_reader* r = find_reader(handle);
+    if (r == NULL) {
+        return 0;
+    }
+    frame_ring* ring = &r->ring;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    int moved = 0;
+    while (tail != head) {
+        unsigned char prefix[4];
+        for (int i = 0; i < 4; i++) {
+            prefix[i] = ring->data[(tail + (uint64_t)i) & ring->mask];
+        }
+        int size = read_be32(prefix) + 4;
+        if (capacity - offset - moved < size) {
+            break;
+        }
+        uint64_t at = tail & ring->mask;
+        uint64_t first = ring->mask + 1 - at < (uint64_t)size ? ring->mask + 1 - at
+                                                               : (uint64_t)size;
+        memcpy(buffer + offset + moved, ring->data + at, first);
+        memcpy(buffer + offset + moved + first, ring->data, (size_t)size - first);
+        moved += size;
+        tail += (uint64_t)size;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return moved;
+}
+
+// Block until the ring has a frame, spinning for the reader's busy poll
+// budget before sleeping
+// Returns 1 if data is ready, 0 on timeout, -1 if the reader stopped
+int ibmoon_reader_wait(int handle, int timeout_ms) {
+    frame_reader* r = find_reader(handle);
+    if (r == NULL) {
+        return -1;
+    }
+#ifdef _WIN32
+    (void)timeout_ms;
+    return -1;
+#else
+    frame_ring* ring = &r->ring;
+    if (r->busy_poll_us > 0) {
+        int64_t spin_until = monotonic_us() + r->busy_poll_us;
+        do {
+            if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+                return 1;
+            }
+            cpu_relax();
+        } while (monotonic_us() < spin_until);
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int result = 0;
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) {
+            result = 1;
+        } else if (__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)) {
+            result = -1;
+        }
+        if (result != 0 || pthread_cond_timedwait(&r->ready, &r->lock, &deadline) != 0) {
+            break;
+        }
+    }
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+    return result;
+#endif
+}
+
+// Stop the reader thread and free its ring; the socket stays open
+int ibmoon_reader_stop(int handle) {
+    frame_reader* r = find_reader(handle);
+    if (r == NULL) {
+        return -1;
+    }
+#ifndef _WIN32
+    __atomic_store_n(&r->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->ready);
+#endif
+    free(r->ring.data);
+    r->ring.data = NULL;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Outbound submission queue
+// Producers on any thread push fully encoded messages with
+// ibmoon_outbound_submit: each message is copied into its own node and
+// linked with one atomic exchange (an intrusive MPSC queue), so producers
+// never take a lock. The connection's writer is the single consumer:
+// ibmoon_outbound_flush pops up to OUTBOUND_BATCH messages and hands them
+// to the kernel in one vectored write. The writer is either the MoonBit process
+// loop or, if requested at open, a dedicated writer thread
+
+#define MAX_OUTBOUND_QUEUES 16
+#define OUTBOUND_BATCH 64
+
+typedef struct outbound_node {
+    struct outbound_node* next;
+    int length;
+    // Message bytes follow the node
+} outbound_node;
+
+typedef struct {
+    int in_use;
+    int socket_id;
+    // Producers exchange themselves in at head; the consumer pops at tail
+    outbound_node* head;
+    char pad_head[56];
+    outbound_node* tail;
+    outbound_node stub;
+    int pending;
+    int failed;
+    int stop;
+    // Set while the writer thread sleeps
+    int waiting;
+    int has_writer;
+#ifndef _WIN32
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+#endif
+} outbound_queue;
+
+static outbound_queue outbound_queues[MAX_OUTBOUND_QUEUES];
+
+static outbound_queue* find_outbound(int handle) {
+    if (handle < 0 || handle >= MAX_OUTBOUND_QUEUES || !outbound_queues[handle].in_use) {
+        return NULL;
+    }
+    return &outbound_queues[handle];
+}
+
+static void outbound_push(outbound_queue* q, outbound_node* node) {
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    outbound_node* prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// Oldest message, or NULL if empty or a producer is between its two steps
+static outbound_node* outbound_pop(outbound_queue* q) {
+    outbound_node* tail = q->tail;
+    outbound_node* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    outbound_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Send one batch; returns messages sent, or -1 once the socket has failed
+static int outbound_flush_batch(outbound_queue* q) {
+    outbound_node* nodes[OUTBOUND_BATCH];
+    int count = 0;
+    while (count < OUTBOUND_BATCH) {
+        outbound_node* node = outbound_pop(q);
+        if (node == NULL) {
+            break;
+        }
+        nodes[count++] = node;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    int result = count;
+    SOCKET sock = acquire_socket(q->socket_id);
+    if (sock == INVALID_SOCKET) {
+        result = -1;
+    }
+#ifdef _WIN32
+    for (int i = 0; i < count && result > 0; i++) {
+        const char* data = (const char*)(nodes[i] + 1);
+        int sent = 0;
+        while (sent < nodes[i]->length) {
+            int n = send(sock, data + sent, nodes[i]->length - sent, 0);
+            if (n == SOCKET_ERROR) {
+                result = -1;
+                break;
+            }
+            sent += n;
+        }
+    }
+#else
+    struct iovec iov[OUTBOUND_BATCH];
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void*)(nodes[i] + 1);
+        iov[i].iov_len = (size_t)nodes[i]->length;
+    }
+    // Blocking socket: loop only on a partial write or a signal. sendmsg
+    // is writev with flags; EPIPE after a close fails the queue
+    int first = result < 0 ? count : 0;
+    while (first < count) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = count - first;
+        ssize_t n = sendmsg(sock, &msg, SEND_FLAGS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        while (first < count && (size_t)n >= iov[first].iov_len) {
+            n -= (ssize_t)iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char*)iov[first].iov_base + n;
+            iov[first].iov_len -= (size_t)n;
+        }
+    }
+#endif
+    if (sock != INVALID_SOCKET) {
+        release_socket(q->socket_id);
+    }
+    for (int i = 0; i < count; i++) {
+        free(nodes[i]);
+    }
+    __atomic_sub_fetch(&q->pending, count, __ATOMIC_ACQ_REL);
+    if (result < 0) {
+        __atomic_store_n(&q->failed, 1, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+#ifndef _WIN32
+static void* outbound_writer_main(void* arg) {
+    outbound_queue* q = (outbound_queue*)arg;
+    while (!__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+        int sent = outbound_flush_batch(q);
+        if (sent < 0) {
+            break;
+        }
+        if (sent > 0) {
+            continue;
+        }
+        pthread_mutex_lock(&q->lock);
+        __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->pending, __ATOMIC_SEQ_CST) == 0 &&
+            !__atomic_load_n(&q->stop, __ATOMIC_SEQ_CST)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&q->ready, &q->lock, &deadline);
+        }
+        __atomic_store_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+#endif
+
+// Open a queue writing to socket_id, with its own writer thread if
+// writer_thread is set (POSIX only). Returns a queue handle or -1
+int ibmoon_outbound_open(int socket_id, int writer_thread) {
+    if (acquire_socket(socket_id) == INVALID_SOCKET) {
+        return -1;
+    }
+    release_socket(socket_id);
+#ifdef _WIN32
+    if (writer_thread) {
+        return -1;
+    }
+#endif
+    int handle = -1;
+    for (int i = 0; i < MAX_OUTBOUND_QUEUES && handle < 0; i++) {
+        if (claim_handle(&outbound_queues[i].in_use)) {
+            handle = i;
+        }
+    }
+    if (handle < 0) {
+        return -1;
+    }
+    outbound_queue* q = &outbound_queues[handle];
+    memset(&q->socket_id, 0, sizeof(*q) - offsetof(outbound_queue, socket_id));
+    q->socket_id = socket_id;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+#ifndef _WIN32
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready, NULL);
+    if (writer_thread) {
+        if (pthread_create(&q->writer, NULL, outbound_writer_main, q) != 0) {
+            pthread_mutex_destroy(&q->lock);
+            pthread_cond_destroy(&q->ready);
+            __atomic_store_n(&q->in_use, 0, __ATOMIC_RELEASE);
+            return -1;
+        }
+        q->has_writer = 1;
+    }
+#endif
+    return handle;
+}
+
+// Queue a copy of data[0, length); safe from any thread
+// Returns 0, or -1 if the queue is unknown or its socket has failed
+int ibmoon_outbound_submit(int handle, const unsigned char* data, int length) {
+    outbound_queue* q = find_outbound(handle);
+    if (q == NULL || length < 0 || __atomic_load_n(&q->failed, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    outbound_node* node = (outbound_node*)malloc(sizeof(outbound_node) + (size_t)length);
+    if (node == NULL) {
+        return -1;
+    }
+    node->length = length;
+    memcpy(node + 1, data, (size_t)length);
+    __atomic_add_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+    outbound_push(q, node);
+#ifndef _WIN32
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+    }
+#endif
+    return 0;
+}
+
+// Messages submitted but not yet written
+int ibmoon_outbound_pending(int handle) {
+    outbound_queue* q = find_outbound(handle);
+    return q == NULL ? 0 : __atomic_load_n(&q->pending, __ATOMIC_ACQUIRE);
+}
+
+// Write everything queued so far, in writev batches; only for queues
+// without a writer thread. Returns messages sent, or -1 on a socket error
+int ibmoon_outbound_flush(int handle) {
+    outbound_queue* q = find_outbound(handle);
+    if (q == NULL || q->has_writer) {
+        return -1;
+    }
+    int total = 0;
+    for (;;) {
+        int sent = outbound_flush_batch(q);
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            return total;
+        }
+        total += sent;
+    }
+}
+
+// Stop the writer thread, write what is left and free the queue
+// Producers must have stopped submitting
+int ibmoon_outbound_close(int handle) {
+    outbound_queue* q = find_outbound(handle);
+    if (q == NULL) {
+        return -1;
+    }
+#ifndef _WIN32
+    if (q->has_writer) {
+        __atomic_store_n(&q->stop, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+        pthread_join(q->writer, NULL);
+        q->has_writer = 0;
+    }
+#endif
+    int result = ibmoon_outbound_flush(handle);
+    // Free anything a failed socket left behind
+    outbound_node* node;
+    while ((node = outbound_pop(q)) != NULL) {
+        free(node);
+    }
+#ifndef _WIN32
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->ready);
+#endif
+    __atomic_store_n(&q->in_use, 0, __ATOMIC_RELEASE);
+    return result < 0 ? -1 : 0;
+}
+
+// File snapshots
+// Returns file size in bytes, or -1 if the file cannot be read
+int ibmoon_file_size(const char* path) {
+#ifdef _WIN32
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return (int)size;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    return (int)st.st_size;
+#endif
+}
+
+// Read a file into buffer with plain reads
+// Returns the number of bytes read, or -1 on error
+int ibmoon_file_read(const char* path, unsigned char* buffer, int buffer_len) {
+#ifdef _WIN32
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t n = fread(buffer, 1, (size_t)buffer_len, f);
+    fclose(f);
+    return (int)n;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int total = 0;
+    while (total < buffer_len) {
+        ssize_t n = read(fd, buffer + total, (size_t)(buffer_len - total));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += (int)n;
+    }
+    close(fd);
+    return total;
+#endif
+}
+
+#ifndef _WIN32
+// fsync the directory holding path, so a rename into it survives a crash
+static int sync_parent_dir(const char* path) {
+    char dir[4096];
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        size_t len = (size_t)(slash - path);
+        if (len >= sizeof(dir)) {
+            return -1;
+        }
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+#endif
+
+// Remove a file; returns 0 on success or if it did not exist, -1 on error
+int ibmoon_file_remove(const char* path) {
+    if (remove(path) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+// Write a file atomically and durably: write and fsync a temporary file,
+// rename it over path, then fsync the directory so the rename persists
+// Returns 0 on success, -1 on error
+int ibmoon_file_write(const char* path, const unsigned char* data, int length) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return -1;
+    }
+#ifdef _WIN32
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t written = fwrite(data, 1, (size_t)length, f);
+    int synced = fflush(f) == 0 && _commit(_fileno(f)) == 0;
+    if (fclose(f) != 0 || written != (size_t)length || !synced) {
+        remove(tmp_path);
+        return -1;
+    }
+    remove(path);
+    if (rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+#else
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int total = 0;
+    while (total < length) {
+        ssize_t n = write(fd, data + total, (size_t)(length - total));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += (int)n;
+    }
+    if (total != length || fsync(fd) != 0) {
+        close(fd);
+        remove(tmp_path);
+        return -1;
+    }
+    if (close(fd) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return sync_parent_dir(path) == 0 ? 0 : -1;
+#endif
+}
@@ -0,0 +1,94 @@
+// Concurrency tests for the socket table in socket_impl.c (POSIX)
+// Not part of the MoonBit build; run with
+//   cc -O1 -g -pthread -fsanitize=thread socket_impl_test.c -o socket_impl_test
+//   ./socket_impl_test
+
+#include "socket_impl.c"
+
+#include <assert.h>
+
+#define RECEIVERS 4
+#define ROUNDS 200
+
+typedef struct {
+    int socket_id;
+    int result;
+} receiver_arg;
+
+// Blocks in ibmoon_socket_receive_into until the socket is closed under it
+static void* receiver_main(void* arg) {
+    receiver_arg* a = (receiver_arg*)arg;
+    unsigned char buffer[64];
+    int n;
+    do {
+        n = ibmoon_socket_receive_into(a->socket_id, buffer, 0, sizeof(buffer), 0, 0);
+    } while (n > 0);
+    a->result = n;
+    return NULL;
+}
+
+static int stale_probes_stop = 0;
+static int stale_hits = 0;
+
+// Keeps acquiring ids that have been closed; none may ever succeed
+static void* stale_prober_main(void* arg) {
+    int* stale_ids = (int*)arg;
+    while (!__atomic_load_n(&stale_probes_stop, __ATOMIC_ACQUIRE)) {
+        for (int i = 0; i < ROUNDS; i++) {
+            int id = __atomic_load_n(&stale_ids[i], __ATOMIC_ACQUIRE);
+            if (id != 0 && acquire_socket(id) != INVALID_SOCKET) {
+                __atomic_add_fetch(&stale_hits, 1, __ATOMIC_RELAXED);
+                release_socket(id);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Close races blocked receivers: close returns, every receiver wakes, and
+// the slot is reused without stale ids or leftover users reaching it
+static void test_close_versus_receive(void) {
+    static int stale_ids[ROUNDS];
+    pthread_t prober;
+    pthread_create(&prober, NULL, stale_prober_main, stale_ids);
+    for (int round = 0; round < ROUNDS; round++) {
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        int id = store_socket(fds[0]);
+        assert(id > 0);
+        receiver_arg args[RECEIVERS];
+        pthread_t threads[RECEIVERS];
+        for (int i = 0; i < RECEIVERS; i++) {
+            args[i].socket_id = id;
+            args[i].result = 1;
+            pthread_create(&threads[i], NULL, receiver_main, &args[i]);
+        }
+        if (round % 2 == 0) {
+            assert(write(fds[1], "x", 1) == 1);
+        }
+        int ok, value, error;
+        ibmoon_socket_close(id, &ok, &value, &error);
+        assert(ok == 1);
+        for (int i = 0; i < RECEIVERS; i++) {
+            pthread_join(threads[i], NULL);
+            assert(args[i].result <= 0);
+        }
+        // A second close of the same id is rejected, not a double close
+        ibmoon_socket_close(id, &ok, &value, &error);
+        assert(ok == 0 && error == ERROR_INVALID_SOCKET);
+        assert(acquire_socket(id) == INVALID_SOCKET);
+        socket_slot* slot = &socket_slots[id & (MAX_SOCKETS - 1)];
+        assert((__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) & SLOT_USERS) == 0);
+        __atomic_store_n(&stale_ids[round], id, __ATOMIC_RELEASE);
+        close(fds[1]);
+    }
+    __atomic_store_n(&stale_probes_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(prober, NULL);
+    assert(stale_hits == 0);
+}
+
+int main(void) {
+    test_close_versus_receive();
+    printf("socket_impl_test: ok\n");
+    return 0;
+}